@@ -43,10 +43,20 @@
 // *-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*'^^'*-,_,-*  //
 //----------------------------------------------------------------------------//
 
+// getopt_long, clock_gettime and friends aren't part of plain C99
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -54,9 +64,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 //----------------------------------------------------------------------------//
 // -*'^'*-,__,-*'^'*-,__,-*' Macros and definitions '*-,__,-*'^'*-,__,-*'^'*- //
@@ -73,6 +89,68 @@
 /// Default working directory to chdir() into.
 #define DEFAULT_WORKING_DIR				"/"
 
+/// Default directory to look for the cpu/memory/io pressure-stall files in.
+/// A cgroup v2 directory (containing cpu.pressure etc.) works too.
+#define DEFAULT_PSI_PATH				"/proc/pressure"
+/// Default PSI trigger window, in microseconds. The kernel accepts 500ms-10s.
+#define DEFAULT_PSI_WINDOW_US			1000000
+/// Default stall time per window, in microseconds, which counts as pressure.
+/// 0 disables monitoring of that resource.
+#define DEFAULT_PSI_CPU_US				100000
+#define DEFAULT_PSI_MEMORY_US			50000
+#define DEFAULT_PSI_IO_US				100000
+/// Default queue latency above which the daemon backs off, in microseconds.
+#define DEFAULT_QUEUE_TARGET_US			10000
+/// Default queue latency above which work is shed outright, in microseconds.
+#define DEFAULT_QUEUE_SHED_US			50000
+/// Default bounds for the number of in-flight work items.
+#define DEFAULT_MIN_INFLIGHT			1
+#define DEFAULT_MAX_INFLIGHT			1024
+/// Default bounds for the accept rate, in work items per second.
+#define DEFAULT_MIN_ACCEPT_RATE			10
+#define DEFAULT_MAX_ACCEPT_RATE			100000
+/// Default interval between adaptive concurrency adjustments, in milliseconds.
+#define DEFAULT_CONTROL_INTERVAL_MS		100
+
+/// Default path to dump traces to. The daemon chdir()s to
+/// DEFAULT_WORKING_DIR, so relative paths are relative to that.
+#define DEFAULT_TRACE_FILE				"/var/log/" DAEMON_NAME ".trace.json"
+/// Number of events in each thread's trace ring. Must be a power of two.
+#define TRACE_RING_EVENTS				65536
+
+/// Default UDP ingestion port. 0 disables UDP ingestion.
+#define DEFAULT_UDP_PORT				0
+/// Default address to bind the UDP ingestion sockets to.
+#define DEFAULT_UDP_BIND				"0.0.0.0"
+/// Default number of UDP worker threads, each with its own socket.
+#define DEFAULT_UDP_WORKERS				1
+/// Default number of datagrams read per recvmmsg() call.
+#define DEFAULT_UDP_BATCH				32
+/// Default number of batches in each worker's ring.
+#define DEFAULT_UDP_RING				4
+/// Default size of each datagram buffer. UDP GRO can coalesce up to 64KiB.
+#define DEFAULT_UDP_BUF_SIZE			65536
+/// Default socket receive buffer size (SO_RCVBUF). 0 keeps the system default.
+#define DEFAULT_UDP_RCVBUF				0
+
+/// Upper bound on the number of segments the kernel coalesces into a
+/// single UDP GRO datagram.
+#define UDP_MAX_GRO_SEGMENTS			128
+/// Size of the ancillary data buffer for each datagram.
+#define UDP_CTRL_SIZE					64
+/// How long a blocked recvmmsg() waits before checking for shutdown, in ms.
+#define UDP_RECV_TIMEOUT_MS				200
+/// Interval between UDP ingestion statistics log messages, in milliseconds.
+#define UDP_STATS_INTERVAL_MS			5000
+
+/// Additive increase of the in-flight limit per uncongested interval.
+#define AIMD_INFLIGHT_INCREASE			4
+/// Additive increase of the accept rate per uncongested interval, as a
+/// fraction (1/n) of the maximum accept rate.
+#define AIMD_ACCEPT_RATE_DIVISOR		100
+/// Percentage the limits are multiplied by on each congested interval.
+#define AIMD_DECREASE_PERCENT			70
+
 /**
  * perror()-like macro which logs the error using syslog() instead.
  * Supports variadic arguments too.
@@ -81,6 +159,21 @@
  */
 #define perror_syslog(s, ...) syslog(LOG_ERR, s ": %s", ##__VA_ARGS__, strerror(errno))
 
+/**
+ * Tracing macros. Each records an event in the calling thread's trace ring
+ * if tracing is enabled, and costs a single branch otherwise.
+ * @param name The event name. Must be a string constant.
+ */
+#define trace_event(phase, name) \
+	do { \
+		if (__builtin_expect(trace_enabled, 0)) { \
+			trace_record((phase), (name)); \
+		} \
+	} while (0)
+#define trace_begin(name) trace_event('B', name)
+#define trace_end(name) trace_event('E', name)
+#define trace_instant(name) trace_event('i', name)
+
 // Helper macros for parse_config_file. These should not be used
 // anywhere else.
 #define isvalididentifier(c) (isalnum((c)) || (c) == '_' || (c) == '-')
@@ -110,6 +203,15 @@
 			goto end; \
 		} \
 	} while (0)
+#define try_validate_unsigned(dest) \
+	do { \
+		if (validate_unsigned((const char*) val_tmp, &(dest)) < 0) { \
+			/* invalid value */ \
+			errno = EINVAL; \
+			ret = 1; \
+			goto end; \
+		} \
+	} while (0)
 
 //----------------------------------------------------------------------------//
 // -*'^'*-,__,-*'^'*-,__,-*' typedefs and structures *-,__,-*'^'*-,__,-*'^'*- //
@@ -128,8 +230,243 @@ typedef struct {
 	char verbose;
 	/// syslog ident
 	char syslog_ident[256];
+	/// Whether event tracing is enabled
+	char trace;
+	/// Path to dump traces to
+	char trace_file[256];
+	/// Whether PSI-driven adaptive concurrency control is enabled
+	char adaptive;
+	/// Directory containing the pressure-stall files
+	char psi_path[256];
+	/// PSI trigger window, in microseconds
+	unsigned psi_window_us;
+	/// Stall time per window (us) which counts as cpu pressure, 0 = ignore
+	unsigned psi_cpu_us;
+	/// Stall time per window (us) which counts as memory pressure, 0 = ignore
+	unsigned psi_memory_us;
+	/// Stall time per window (us) which counts as io pressure, 0 = ignore
+	unsigned psi_io_us;
+	/// Queue latency (us) above which the limits are backed off
+	unsigned queue_target_us;
+	/// Queue latency (us) above which work is shed without being processed
+	unsigned queue_shed_us;
+	/// Lower bound for the in-flight limit
+	unsigned min_inflight;
+	/// Upper bound for the in-flight limit
+	unsigned max_inflight;
+	/// Lower bound for the accept rate, in work items per second
+	unsigned min_accept_rate;
+	/// Upper bound for the accept rate, in work items per second
+	unsigned max_accept_rate;
+	/// Interval between limit adjustments, in milliseconds
+	unsigned control_interval_ms;
+	/// UDP ingestion port, 0 = disabled
+	unsigned udp_port;
+	/// Address to bind the UDP ingestion sockets to
+	char udp_bind[64];
+	/// Number of UDP worker threads
+	unsigned udp_workers;
+	/// Number of datagrams read per recvmmsg() call
+	unsigned udp_batch;
+	/// Number of batches in each worker's ring
+	unsigned udp_ring;
+	/// Size of each datagram buffer
+	unsigned udp_buf_size;
+	/// Socket receive buffer size, 0 = system default
+	unsigned udp_rcvbuf;
 } options_t;
 
+/**
+ * A single trace event.
+ */
+typedef struct {
+	/// Timestamp, as returned by trace_timestamp
+	uint64_t ts;
+	/// Event name
+	const char *name;
+	/// Chrome trace event phase: 'B'egin, 'E'nd, or 'i'nstant
+	char phase;
+} trace_event_t;
+
+/**
+ * A per-thread trace ring. Only the owning thread writes to it, so
+ * recording an event needs no locking, and the ring can be read by the
+ * thread dumping the trace at any time.
+ */
+typedef struct trace_ring {
+	/// Events, indexed by sequence number modulo TRACE_RING_EVENTS
+	trace_event_t events[TRACE_RING_EVENTS];
+	/// Sequence number of the next event to be recorded
+	uint64_t head;
+	/// Thread ID
+	int tid;
+	/// Thread name, for the trace viewer
+	char name[16];
+	/// Next ring in trace_rings
+	struct trace_ring *next;
+} trace_ring_t;
+
+/// Number of pressure-stall resources monitored (cpu, memory and io).
+#define PSI_NUM_RESOURCES 3
+
+/**
+ * A single pressure-stall resource being monitored.
+ */
+typedef struct {
+	/// Resource name, e.g.: "cpu"
+	const char *name;
+	/// Stall time per window (us) which counts as pressure
+	unsigned threshold_us;
+	/// Pressure file descriptor, or -1 if the resource isn't monitored
+	int fd;
+	/// 1 if a kernel trigger is registered on fd, 0 if it's sampled instead
+	char trigger;
+	/// Last "some" total stall time read from the file, in microseconds
+	unsigned long long last_total_us;
+	/// Time until which a fired trigger counts as pressure, in nanoseconds
+	uint64_t hold_until_ns;
+} psi_resource_t;
+
+/**
+ * Pressure-stall monitor state. Triggers are used where the kernel allows
+ * them; otherwise the files are sampled every control interval.
+ */
+typedef struct {
+	psi_resource_t res[PSI_NUM_RESOURCES];
+	/// PSI trigger window, in microseconds
+	unsigned window_us;
+} psi_monitor_t;
+
+/**
+ * AIMD admission controller state. Work is shed as early as possible: by
+ * admission_accept as it arrives (token bucket limited by accept_rate), and
+ * by admission_begin before it's queued (limited by the in-flight limit,
+ * with the caller counting what's in flight, e.g.: as its queue length).
+ * Work dequeued after waiting longer than queue_shed_us is shed too, see
+ * admission_expired. A controller belongs to one thread, and is only ever
+ * touched by that thread.
+ */
+typedef struct {
+	/// Name of the work being controlled, for log messages
+	const char *name;
+	/// Current in-flight limit
+	unsigned limit;
+	/// Current accept rate, in work items per second
+	double accept_rate;
+	/// Accept tokens currently available
+	double tokens;
+	/// Time the token bucket was last refilled, in nanoseconds
+	uint64_t last_refill_ns;
+	/// Highest queue latency seen during the current interval, in nanoseconds
+	uint64_t qlat_max_ns;
+	/// Time of the last adjustment, in nanoseconds
+	uint64_t last_update_ns;
+	/// Whether the last adjustment was a back-off
+	char congested;
+} admission_t;
+
+/**
+ * A single datagram, pointing into the buffers of the batch it came in.
+ */
+typedef struct {
+	/// Start of the datagram
+	const uint8_t *data;
+	/// Length of the datagram
+	size_t len;
+	/// Sender address
+	const struct sockaddr *from;
+} udp_datagram_t;
+
+/**
+ * One preallocated recvmmsg() batch. The receiving thread reads into it,
+ * splits any GRO-coalesced datagrams, and hands it to the consumer, which
+ * hands it back once done - the datagram data itself is never copied.
+ */
+typedef struct {
+	/// recvmmsg() message headers
+	struct mmsghdr *msgs;
+	/// One iovec per message
+	struct iovec *iovs;
+	/// Sender addresses, one per message
+	struct sockaddr_storage *addrs;
+	/// Datagram buffers, udp_buf_size bytes per message
+	uint8_t *bufs;
+	/// Ancillary data buffers, UDP_CTRL_SIZE bytes per message
+	uint8_t *ctrl;
+	/// Parsed datagrams
+	udp_datagram_t *dgrams;
+	/// Number of parsed datagrams
+	unsigned ndgrams;
+	/// Time the batch was received, in nanoseconds
+	uint64_t received_ns;
+} udp_batch_t;
+
+/**
+ * A UDP worker: one SO_REUSEPORT socket, with a receiving thread and a
+ * consumer thread connected by a ring of batches.
+ */
+typedef struct {
+	/// Worker index
+	unsigned index;
+	/// Daemon options
+	const options_t *opts;
+	/// The worker's socket
+	int fd;
+	/// Receiving and consumer threads
+	pthread_t rx_thread, consumer_thread;
+	/// Whether each thread was started
+	char rx_started, consumer_started;
+	/// Set to make the threads exit
+	int stop;
+	/// Set by the receiving thread once it has exited
+	int rx_done;
+	/// Batch ring
+	udp_batch_t *ring;
+	/// Number of batches handed to, and handed back by, the consumer. The
+	/// ring holds batches [consumed, produced), modulo its size.
+	unsigned long produced, consumed;
+	/// Protects produced, consumed and rx_done
+	pthread_mutex_t lock;
+	/// Signalled when a batch is produced or consumed
+	pthread_cond_t cond;
+	/// Datagrams received (after splitting GRO datagrams)
+	unsigned long long packets;
+	/// Bytes received
+	unsigned long long bytes;
+	/// recvmmsg() calls which returned data
+	unsigned long long batches;
+	/// Datagrams dropped by the kernel, as reported by SO_RXQ_OVFL
+	unsigned long long drops;
+	/// Datagrams truncated because udp_buf_size was too small
+	unsigned long long truncated;
+	/// Datagrams dropped because they didn't fit in the batch's datagram
+	/// array (more than UDP_MAX_GRO_SEGMENTS segments per message)
+	unsigned long long overflowed;
+	/// Datagrams shed by admission control
+	unsigned long long shed;
+	/// The receiving thread's admission controller. Datagrams are accepted
+	/// one by one, and a batch queued in the ring is a work item in flight.
+	admission_t adm;
+	/// Longest time a batch waited in the ring since the receiving thread
+	/// last picked it up, in nanoseconds. Published by the consumer thread.
+	uint64_t qlat_max_ns;
+	/// Name of the admission controller, e.g.: "UDP worker 0"
+	char adm_name[24];
+	/// Datagrams and thread CPU time at the last statistics log message
+	unsigned long long last_packets;
+	uint64_t last_cpu_ns;
+} udp_worker_t;
+
+/**
+ * UDP ingestion state.
+ */
+typedef struct {
+	/// Workers
+	udp_worker_t *workers;
+	/// Number of workers
+	unsigned nworkers;
+} udp_ingest_t;
+
 //----------------------------------------------------------------------------//
 // -*'^'*-,__,-*'^'*-,__,-*'^'* Global constants *'^'*-,__,-*'^'*-,__,-*'^'*- //
 //----------------------------------------------------------------------------//
@@ -150,17 +487,21 @@ static const struct option long_options[] = {
 	{"foreground",	no_argument,		0,	'f'},
 	{"config",		required_argument,	0,	'c'},
 	{"ident",		required_argument,	0,	'Z'},
+	{"adaptive",	no_argument,		0,	'a'},
+	{"udp-port",	required_argument,	0,	'u'},
+	{"trace",		no_argument,		0,	't'},
 	{0,				0,					0,	0}
 };
 
 /// More stuff for getopt_long.
-static const char *short_options = "hvVdfc:Z:";
+static const char *short_options = "hvVdfc:Z:au:t";
 
 /// Short help message.
 static const char *short_usage =
 "[-h, --help] [-v, --version] [-V, --verbose]\n"
 "    [-d, --daemonize] [-f, --foreground] [-c, --config <path>]\n"
-"    [-Z, --ident <ident>]\n";
+"    [-Z, --ident <ident>] [-a, --adaptive] [-u, --udp-port <port>]\n"
+"    [-t, --trace]\n";
 
 /// General help message for the above options
 static const char *long_usage =
@@ -177,7 +518,10 @@ static const char *long_usage =
 	" -f, --foreground     Run in the foreground.\n"
 #endif
 " -c, --config <path>  Use the specified config file.\n"
-" -Z, --ident <str>    Use the specified string as the syslog ident.\n";
+" -Z, --ident <str>    Use the specified string as the syslog ident.\n"
+" -a, --adaptive       Enable PSI-driven adaptive concurrency control.\n"
+" -u, --udp-port <n>   Ingest UDP datagrams on the specified port.\n"
+" -t, --trace          Record trace events, dumping them on SIGUSR1.\n";
 
 //----------------------------------------------------------------------------//
 // -*'^'*-,__,-*'^'*-,__,-*'^'* Utility routines *'^'*-,__,-*'^'*-,__,-*'^'*- //
@@ -285,16 +629,16 @@ static int validate_boolean(const char *str) {
 			break;
 		case 3:
 			if (tolower(str[0]) == 'y' && tolower(str[1]) == 'e' && tolower(str[2]) == 's') {
-				return 0;
+				return 1;
 			}
 			break;
 		case 4:
-			if (tolower(str[0]) == 't' && tolower(str[1]) == 'r' && tolower(str[2]) == 'u' && tolower(str[2]) == 'e') {
+			if (tolower(str[0]) == 't' && tolower(str[1]) == 'r' && tolower(str[2]) == 'u' && tolower(str[3]) == 'e') {
 				return 1;
 			}
 			break;
 		case 5:
-			if (tolower(str[0]) == 'f' && tolower(str[1]) == 'a' && tolower(str[2]) == 'l' && tolower(str[2]) == 's' && tolower(str[2]) == 'e') {
+			if (tolower(str[0]) == 'f' && tolower(str[1]) == 'a' && tolower(str[2]) == 'l' && tolower(str[3]) == 's' && tolower(str[4]) == 'e') {
 				return 0;
 			}
 			break;
@@ -303,6 +647,40 @@ static int validate_boolean(const char *str) {
 	return -1;
 }
 
+/**
+ * Helper function to validate an unsigned decimal integer string.
+ * Trailing whitespace is ignored.
+ * @param str The string to validate.
+ * @param dest Where to store the value, if valid.
+ * @return 0 if the string is valid, -1 if it's invalid.
+ */
+static int validate_unsigned(const char *str, unsigned *dest) {
+	char *end;
+	unsigned long val;
+	
+	if (!isdigit((unsigned char) str[0])) {
+		return -1;
+	}
+	errno = 0;
+	val = strtoul(str, &end, 10);
+	while (isspace((unsigned char) *end)) { end++; }
+	if (errno != 0 || *end != '\0' || val > UINT_MAX) {
+		return -1;
+	}
+	*dest = (unsigned) val;
+	return 0;
+}
+
+/**
+ * Returns the current CLOCK_MONOTONIC time.
+ * @return The time in nanoseconds.
+ */
+static uint64_t monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
 /**
  * Usage function. Outputs usage information to stderr and exits with
  * the specified return code.
@@ -335,6 +713,81 @@ static void version() {
 static void init_options(options_t *opts) {	
 	memset((void*) opts, 0, sizeof(*opts));
 	strncpy(opts->syslog_ident, daemon_name, sizeof(opts->syslog_ident));
+	strncpy(opts->trace_file, DEFAULT_TRACE_FILE, sizeof(opts->trace_file) - 1);
+	strncpy(opts->psi_path, DEFAULT_PSI_PATH, sizeof(opts->psi_path) - 1);
+	opts->psi_window_us = DEFAULT_PSI_WINDOW_US;
+	opts->psi_cpu_us = DEFAULT_PSI_CPU_US;
+	opts->psi_memory_us = DEFAULT_PSI_MEMORY_US;
+	opts->psi_io_us = DEFAULT_PSI_IO_US;
+	opts->queue_target_us = DEFAULT_QUEUE_TARGET_US;
+	opts->queue_shed_us = DEFAULT_QUEUE_SHED_US;
+	opts->min_inflight = DEFAULT_MIN_INFLIGHT;
+	opts->max_inflight = DEFAULT_MAX_INFLIGHT;
+	opts->min_accept_rate = DEFAULT_MIN_ACCEPT_RATE;
+	opts->max_accept_rate = DEFAULT_MAX_ACCEPT_RATE;
+	opts->control_interval_ms = DEFAULT_CONTROL_INTERVAL_MS;
+	opts->udp_port = DEFAULT_UDP_PORT;
+	strncpy(opts->udp_bind, DEFAULT_UDP_BIND, sizeof(opts->udp_bind));
+	opts->udp_workers = DEFAULT_UDP_WORKERS;
+	opts->udp_batch = DEFAULT_UDP_BATCH;
+	opts->udp_ring = DEFAULT_UDP_RING;
+	opts->udp_buf_size = DEFAULT_UDP_BUF_SIZE;
+	opts->udp_rcvbuf = DEFAULT_UDP_RCVBUF;
+}
+
+/**
+ * Checks that the parsed options are consistent, outputting an error
+ * message to stderr for the first problem found.
+ * @param opts The options to check.
+ * @return 0 if the options are valid, -1 otherwise.
+ */
+static int check_options(const options_t *opts) {
+	if (opts->psi_window_us < 500000 || opts->psi_window_us > 10000000) {
+		fprintf(stderr, "psi_window_us must be between 500000 and 10000000\n");
+		return -1;
+	}
+	if (opts->psi_cpu_us > opts->psi_window_us || opts->psi_memory_us > opts->psi_window_us
+			|| opts->psi_io_us > opts->psi_window_us) {
+		fprintf(stderr, "psi thresholds must not exceed psi_window_us\n");
+		return -1;
+	}
+	if (opts->min_inflight == 0 || opts->min_inflight > opts->max_inflight) {
+		fprintf(stderr, "min_inflight must be non-zero and at most max_inflight\n");
+		return -1;
+	}
+	if (opts->min_accept_rate == 0 || opts->min_accept_rate > opts->max_accept_rate) {
+		fprintf(stderr, "min_accept_rate must be non-zero and at most max_accept_rate\n");
+		return -1;
+	}
+	if (opts->queue_target_us > opts->queue_shed_us) {
+		fprintf(stderr, "queue_target_us must be at most queue_shed_us\n");
+		return -1;
+	}
+	if (opts->control_interval_ms == 0) {
+		fprintf(stderr, "control_interval_ms must be non-zero\n");
+		return -1;
+	}
+	if (opts->udp_port > 65535) {
+		fprintf(stderr, "udp_port must be at most 65535\n");
+		return -1;
+	}
+	if (opts->udp_workers == 0 || opts->udp_ring == 0) {
+		fprintf(stderr, "udp_workers and udp_ring must be non-zero\n");
+		return -1;
+	}
+	if (opts->udp_batch == 0 || opts->udp_batch > 1024) {
+		fprintf(stderr, "udp_batch must be between 1 and 1024\n");
+		return -1;
+	}
+	if (opts->udp_buf_size < 64 || opts->udp_buf_size > 1048576) {
+		fprintf(stderr, "udp_buf_size must be between 64 and 1048576\n");
+		return -1;
+	}
+	if (opts->udp_rcvbuf > INT_MAX) {
+		fprintf(stderr, "udp_rcvbuf must be at most %d\n", INT_MAX);
+		return -1;
+	}
+	return 0;
 }
 
 /**
@@ -516,6 +969,50 @@ static int parse_config_file(char *data, options_t *opts) {
 			} else if (identifier_matched("syslog_ident")) {
 				// store the value
 				strncpy(opts->syslog_ident, (const char*) val_tmp, sizeof(opts->syslog_ident));
+			} else if (identifier_matched("trace")) {
+				try_validate_boolean(opts->trace);
+			} else if (identifier_matched("trace_file")) {
+				strncpy(opts->trace_file, (const char*) val_tmp, sizeof(opts->trace_file) - 1);
+			} else if (identifier_matched("adaptive_concurrency")) {
+				try_validate_boolean(opts->adaptive);
+			} else if (identifier_matched("psi_path")) {
+				strncpy(opts->psi_path, (const char*) val_tmp, sizeof(opts->psi_path) - 1);
+			} else if (identifier_matched("psi_window_us")) {
+				try_validate_unsigned(opts->psi_window_us);
+			} else if (identifier_matched("psi_cpu_us")) {
+				try_validate_unsigned(opts->psi_cpu_us);
+			} else if (identifier_matched("psi_memory_us")) {
+				try_validate_unsigned(opts->psi_memory_us);
+			} else if (identifier_matched("psi_io_us")) {
+				try_validate_unsigned(opts->psi_io_us);
+			} else if (identifier_matched("queue_target_us")) {
+				try_validate_unsigned(opts->queue_target_us);
+			} else if (identifier_matched("queue_shed_us")) {
+				try_validate_unsigned(opts->queue_shed_us);
+			} else if (identifier_matched("min_inflight")) {
+				try_validate_unsigned(opts->min_inflight);
+			} else if (identifier_matched("max_inflight")) {
+				try_validate_unsigned(opts->max_inflight);
+			} else if (identifier_matched("min_accept_rate")) {
+				try_validate_unsigned(opts->min_accept_rate);
+			} else if (identifier_matched("max_accept_rate")) {
+				try_validate_unsigned(opts->max_accept_rate);
+			} else if (identifier_matched("control_interval_ms")) {
+				try_validate_unsigned(opts->control_interval_ms);
+			} else if (identifier_matched("udp_port")) {
+				try_validate_unsigned(opts->udp_port);
+			} else if (identifier_matched("udp_bind")) {
+				strncpy(opts->udp_bind, (const char*) val_tmp, sizeof(opts->udp_bind) - 1);
+			} else if (identifier_matched("udp_workers")) {
+				try_validate_unsigned(opts->udp_workers);
+			} else if (identifier_matched("udp_batch")) {
+				try_validate_unsigned(opts->udp_batch);
+			} else if (identifier_matched("udp_ring")) {
+				try_validate_unsigned(opts->udp_ring);
+			} else if (identifier_matched("udp_buf_size")) {
+				try_validate_unsigned(opts->udp_buf_size);
+			} else if (identifier_matched("udp_rcvbuf")) {
+				try_validate_unsigned(opts->udp_rcvbuf);
 			} else {
 				// invalid identifier - error out
 				fprintf(stderr, "config: invalid identifier: %s\n", id_tmp);
@@ -574,6 +1071,18 @@ static int parse_cmdline_opts(int argc, char * const argv[], options_t *opts) {
 			case 'Z':
 				strncpy(opts->syslog_ident, (const char*) optarg, sizeof(opts->syslog_ident));
 				break;
+			case 'a':
+				opts->adaptive = 1;
+				break;
+			case 't':
+				opts->trace = 1;
+				break;
+			case 'u':
+				if (validate_unsigned((const char*) optarg, &opts->udp_port) < 0) {
+					fprintf(stderr, "%s: invalid port: %s\n", argv[0], optarg);
+					return -1;
+				}
+				break;
 			// process any other options here:
 			// case '<character>':
 			//	do_something();
@@ -587,24 +1096,1274 @@ static int parse_cmdline_opts(int argc, char * const argv[], options_t *opts) {
 	return 0;
 }
 
+//----------------------------------------------------------------------------//
+// -*'^'*-,__,-*'^'*-,__,-*'^'*-,__,-*'^' Tracing '^'*-,__,-*'^'*-,__,-*'^'*- //
+//----------------------------------------------------------------------------//
+
+/// Whether tracing is enabled. Only ever set once, by trace_init.
+static int trace_enabled = 0;
+
+/// Set by the SIGUSR1 handler to make daemon_main dump the trace.
+static volatile sig_atomic_t trace_dump_requested = 0;
+
+/// All trace rings created so far, newest first. Rings are never freed, so
+/// events from threads which have exited can still be dumped.
+static trace_ring_t *trace_rings = NULL;
+
+/// The calling thread's trace ring, created on its first event.
+static __thread trace_ring_t *trace_ring = NULL;
+
+/// Timestamp and CLOCK_MONOTONIC time when tracing was enabled.
+static uint64_t trace_start_ts, trace_start_ns;
+
+/**
+ * Returns a trace timestamp. On x86 this is the TSC, which is cheaper to
+ * read than the clock and is converted to nanoseconds at dump time (this
+ * assumes an invariant TSC, as all recent x86 CPUs have). Elsewhere it's
+ * CLOCK_MONOTONIC in nanoseconds.
+ * @return The timestamp.
+ */
+static inline uint64_t trace_timestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return monotonic_ns();
+#endif
+}
+
+/**
+ * Creates the calling thread's trace ring and registers it for dumping.
+ * @return The ring, or NULL if it couldn't be allocated.
+ */
+static trace_ring_t *trace_ring_create() {
+	trace_ring_t *r = (trace_ring_t*) calloc(1, sizeof(*r));
+	if (r == NULL) {
+		return NULL;
+	}
+	r->tid = (int) syscall(SYS_gettid);
+	r->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+	trace_ring = r;
+	return r;
+}
+
+/**
+ * Records an event in the calling thread's trace ring, overwriting the
+ * oldest event once the ring is full. Use the trace_begin, trace_end and
+ * trace_instant macros rather than calling this directly.
+ * @param phase The Chrome trace event phase: 'B', 'E' or 'i'.
+ * @param name The event name. Must be a string constant which doesn't need
+ * escaping in JSON.
+ */
+static void trace_record(char phase, const char *name) {
+	trace_ring_t *r = trace_ring;
+	trace_event_t *ev;
+	uint64_t head;
+	
+	if (r == NULL && (r = trace_ring_create()) == NULL) {
+		return;
+	}
+	// only this thread writes head, so it can be read without synchronization
+	head = r->head;
+	ev = &r->events[head & (TRACE_RING_EVENTS - 1)];
+	// seqlock-style: a reader which sees any of the stores below overwriting
+	// an old event is guaranteed to see the head store before them too, so
+	// that it knows to discard that event
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&ev->ts, trace_timestamp(), __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->name, name, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->phase, phase, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Enables tracing. Does nothing if tracing is already enabled.
+ */
+static void trace_init() {
+	if (trace_enabled) {
+		return;
+	}
+	trace_start_ns = monotonic_ns();
+	trace_start_ts = trace_timestamp();
+	trace_enabled = 1;
+}
+
+/**
+ * Names the calling thread in dumped traces. Does nothing if tracing is
+ * disabled.
+ * @param name The thread name.
+ */
+static void trace_set_thread_name(const char *name) {
+	trace_ring_t *r = trace_ring;
+	
+	if (!trace_enabled || (r == NULL && (r = trace_ring_create()) == NULL)) {
+		return;
+	}
+	snprintf(r->name, sizeof(r->name), "%s", name);
+}
+
+/**
+ * Updates the calling thread's trace ring after fork(), so that events
+ * recorded both before and after forking show up under the child's
+ * thread ID.
+ */
+static void trace_after_fork() {
+	if (trace_ring != NULL) {
+		trace_ring->tid = (int) syscall(SYS_gettid);
+	}
+}
+
+/**
+ * SIGUSR1 handler. Asks daemon_main to dump the trace.
+ * @param sig The signal number.
+ */
+static void handle_trace_signal(int sig) {
+	(void) sig;
+	trace_dump_requested = 1;
+}
+
+/**
+ * Dumps every thread's trace ring to a file in Chrome trace JSON format,
+ * which can be opened in Perfetto or chrome://tracing. The file is written
+ * to a new, private temporary file next to it first, and then renamed into
+ * place. Rings are read
+ * while their threads carry on recording, so events overwritten while
+ * being read are left out.
+ * @param path The path of the file to write.
+ * @return 0 on success, -1 on failure.
+ */
+static int trace_dump(const char *path) {
+	char tmp[PATH_MAX];
+	FILE *f;
+	int fd;
+	trace_ring_t *r;
+	trace_event_t *copy;
+	uint64_t head, start, valid, i, end_ts, end_ns;
+	double ns_per_tick;
+	int pid = (int) getpid(), first = 1;
+	
+	if (!trace_enabled) {
+		return 0;
+	}
+	
+	// work out how long a timestamp tick is from the time traced so far
+	end_ns = monotonic_ns();
+	end_ts = trace_timestamp();
+#if defined(__x86_64__) || defined(__i386__)
+	ns_per_tick = end_ts > trace_start_ts ? (double) (end_ns - trace_start_ns) / (double) (end_ts - trace_start_ts) : 1.0;
+#else
+	ns_per_tick = 1.0;
+#endif
+	
+	copy = (trace_event_t*) malloc(sizeof(r->events));
+	if (copy == NULL) {
+		return -1;
+	}
+	// mkstemp() creates the file exclusively, with mode 0600, so it can't be
+	// pre-created or symlinked elsewhere by anyone else
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int) sizeof(tmp)) {
+		free((void*) copy);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if ((fd = mkstemp(tmp)) < 0) {
+		free((void*) copy);
+		return -1;
+	}
+	if ((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		free((void*) copy);
+		return -1;
+	}
+	
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", f);
+	for (r = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+		if (r->name[0] != '\0') {
+			fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				first ? "" : ",", pid, r->tid, r->name);
+			first = 0;
+		}
+		
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		start = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+		for (i = start; i < head; i++) {
+			trace_event_t *src = &r->events[i & (TRACE_RING_EVENTS - 1)], *dst = &copy[i & (TRACE_RING_EVENTS - 1)];
+			dst->ts = __atomic_load_n(&src->ts, __ATOMIC_RELAXED);
+			dst->name = __atomic_load_n(&src->name, __ATOMIC_RELAXED);
+			dst->phase = __atomic_load_n(&src->phase, __ATOMIC_RELAXED);
+		}
+		// anything the thread has since wrapped around onto is unreliable. The
+		// fence keeps the copy above from being reordered after the re-read.
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		valid = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		valid = valid >= TRACE_RING_EVENTS ? valid - TRACE_RING_EVENTS + 1 : 0;
+		
+		for (i = start > valid ? start : valid; i < head; i++) {
+			trace_event_t *ev = &copy[i & (TRACE_RING_EVENTS - 1)];
+			fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d%s}",
+				first ? "" : ",", ev->name, ev->phase,
+				(double) (int64_t) (ev->ts - trace_start_ts) * ns_per_tick / 1000.0,
+				pid, r->tid, ev->phase == 'i' ? ",\"s\":\"t\"" : "");
+			first = 0;
+		}
+	}
+	fputs("\n]}\n", f);
+	
+	free((void*) copy);
+	if (fclose(f) != 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+//----------------------------------------------------------------------------//
+// -*'^'*-,__,-*'^'*-,__,-*'^ Adaptive concurrency ^'*-,__,-*'^'*-,__,-*'^'*- //
+//----------------------------------------------------------------------------//
+
+/**
+ * Reads the total "some" stall time from a pressure-stall file, the first
+ * line of which looks like:
+ *   some avg10=0.00 avg60=0.00 avg300=0.00 total=12345
+ * @param fd The pressure file descriptor.
+ * @param total_us Where to store the total stall time, in microseconds.
+ * @return 0 on success, -1 on failure.
+ */
+static int psi_read_total(int fd, unsigned long long *total_us) {
+	char buf[256], *p;
+	ssize_t n;
+	
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		return -1;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	if (n <= 0) {
+		return -1;
+	}
+	buf[n] = '\0';
+	p = strstr(buf, "total=");
+	if (strncmp(buf, "some ", 5) || p == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	*total_us = strtoull(p + 6, NULL, 10);
+	return 0;
+}
+
+/**
+ * Opens the pressure-stall files named by the options, registering a
+ * kernel trigger on each where possible. Resources the kernel won't
+ * register a trigger for (e.g.: unprivileged users on some kernels) are
+ * sampled instead, and resources which can't be opened at all (e.g.: the
+ * kernel was built without PSI) are logged and ignored.
+ * @param mon The monitor to initialize.
+ * @param opts The daemon options.
+ */
+static void psi_open(psi_monitor_t *mon, const options_t *opts) {
+	static const char *names[PSI_NUM_RESOURCES] = {"cpu", "memory", "io"};
+	unsigned thresholds[PSI_NUM_RESOURCES];
+	char path[512], trig[64];
+	psi_resource_t *r;
+	int i, len;
+	
+	thresholds[0] = opts->psi_cpu_us;
+	thresholds[1] = opts->psi_memory_us;
+	thresholds[2] = opts->psi_io_us;
+	mon->window_us = opts->psi_window_us;
+	
+	for (i = 0; i < PSI_NUM_RESOURCES; i++) {
+		r = &mon->res[i];
+		memset((void*) r, 0, sizeof(*r));
+		r->name = names[i];
+		r->threshold_us = thresholds[i];
+		r->fd = -1;
+		if (r->threshold_us == 0) {
+			continue;
+		}
+		
+		// cgroup v2 directories use <name>.pressure, /proc/pressure uses <name>
+		snprintf(path, sizeof(path), "%s/%s.pressure", opts->psi_path, r->name);
+		if (!file_exists(path)) {
+			snprintf(path, sizeof(path), "%s/%s", opts->psi_path, r->name);
+		}
+		
+		r->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (r->fd >= 0) {
+			// the trigger string must be written including its terminator
+			len = snprintf(trig, sizeof(trig), "some %u %u", r->threshold_us, mon->window_us) + 1;
+			if (write(r->fd, trig, len) == len) {
+				r->trigger = 1;
+				if (opts->verbose) {
+					syslog(LOG_INFO, "Registered PSI trigger \"%s\" on %s", trig, path);
+				}
+				continue;
+			}
+			close(r->fd);
+		}
+		
+		// no trigger - fall back to sampling the file every control interval
+		r->fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (r->fd < 0) {
+			perror_syslog("could not open %s", path);
+			continue;
+		}
+		if (psi_read_total(r->fd, &r->last_total_us) < 0) {
+			perror_syslog("could not read %s", path);
+			close(r->fd);
+			r->fd = -1;
+			continue;
+		}
+		if (opts->verbose) {
+			syslog(LOG_INFO, "Sampling %s (no PSI trigger support)", path);
+		}
+	}
+}
+
+/**
+ * Closes any pressure-stall files opened by psi_open.
+ * @param mon The monitor to close.
+ */
+static void psi_close(psi_monitor_t *mon) {
+	int i;
+	for (i = 0; i < PSI_NUM_RESOURCES; i++) {
+		if (mon->res[i].fd >= 0) {
+			close(mon->res[i].fd);
+			mon->res[i].fd = -1;
+		}
+	}
+}
+
+/**
+ * Fills a pollfd array with the monitor's trigger file descriptors.
+ * @param mon The monitor.
+ * @param pfds The destination, which must hold PSI_NUM_RESOURCES entries.
+ * @return The number of entries filled in.
+ */
+static int psi_pollfds(const psi_monitor_t *mon, struct pollfd *pfds) {
+	int i, n = 0;
+	for (i = 0; i < PSI_NUM_RESOURCES; i++) {
+		if (mon->res[i].fd >= 0 && mon->res[i].trigger) {
+			pfds[n].fd = mon->res[i].fd;
+			pfds[n].events = POLLPRI;
+			pfds[n].revents = 0;
+			n++;
+		}
+	}
+	return n;
+}
+
+/**
+ * Processes poll() results for the monitor's trigger file descriptors. A
+ * fired trigger counts as pressure for one full window, as the kernel
+ * only reports it once per window however long the stall lasts.
+ * @param mon The monitor.
+ * @param pfds The pollfd array filled in by psi_pollfds.
+ * @param nfds The number of entries in pfds.
+ * @param now The current time, in nanoseconds.
+ * @return 1 if a trigger went away and pfds must be refilled, 0 otherwise.
+ */
+static int psi_handle_events(psi_monitor_t *mon, const struct pollfd *pfds, int nfds, uint64_t now) {
+	int i, j, changed = 0;
+	psi_resource_t *r;
+	
+	for (i = 0; i < nfds; i++) {
+		if (pfds[i].revents == 0) {
+			continue;
+		}
+		for (j = 0; j < PSI_NUM_RESOURCES; j++) {
+			r = &mon->res[j];
+			if (r->fd != pfds[i].fd) {
+				continue;
+			}
+			if (pfds[i].revents & POLLERR) {
+				// the monitored cgroup has been removed
+				syslog(LOG_WARNING, "PSI trigger for %s went away", r->name);
+				close(r->fd);
+				r->fd = -1;
+				changed = 1;
+			} else if (pfds[i].revents & POLLPRI) {
+				r->hold_until_ns = now + (uint64_t) mon->window_us * 1000;
+			}
+			break;
+		}
+	}
+	return changed;
+}
+
+/**
+ * Works out which resources are currently under pressure. Triggered
+ * resources are checked against their hold time, and sampled resources
+ * have their stall time since the last sample compared against their
+ * threshold, scaled from the window to the time actually elapsed.
+ * @param mon The monitor.
+ * @param now The current time, in nanoseconds.
+ * @param elapsed_us The time since the last call, in microseconds.
+ * @return A bitmask of pressured resources, indexed as in mon->res.
+ */
+static unsigned psi_pressure(psi_monitor_t *mon, uint64_t now, uint64_t elapsed_us) {
+	unsigned i, pressure = 0;
+	unsigned long long total;
+	psi_resource_t *r;
+	
+	for (i = 0; i < PSI_NUM_RESOURCES; i++) {
+		r = &mon->res[i];
+		if (r->fd < 0) {
+			continue;
+		}
+		if (r->trigger) {
+			if (r->hold_until_ns > now) {
+				pressure |= 1u << i;
+			}
+		} else if (psi_read_total(r->fd, &total) == 0) {
+			if (total - r->last_total_us >= (unsigned long long) r->threshold_us * elapsed_us / mon->window_us) {
+				pressure |= 1u << i;
+			}
+			r->last_total_us = total;
+		}
+	}
+	return pressure;
+}
+
+/// Bitmask of resources under pressure as of the last control interval,
+/// indexed as in psi_monitor_t. Published by daemon_main for admission
+/// controllers running in other threads.
+static unsigned admission_pressure = 0;
+
+/**
+ * Initializes an admission controller with the most permissive limits
+ * the options allow.
+ * @param adm The controller to initialize.
+ * @param opts The daemon options.
+ * @param name Name of the work being controlled, for log messages.
+ * @param now The current time, in nanoseconds.
+ */
+static void admission_init(admission_t *adm, const options_t *opts, const char *name, uint64_t now) {
+	memset((void*) adm, 0, sizeof(*adm));
+	adm->name = name;
+	adm->last_update_ns = now;
+	adm->limit = opts->max_inflight;
+	adm->accept_rate = (double) opts->max_accept_rate;
+	adm->tokens = 1.0;
+	adm->last_refill_ns = now;
+}
+
+/**
+ * Decides whether newly arrived work should be accepted, according to the
+ * current accept rate. Bursts of up to one control interval's worth of
+ * work are allowed.
+ * @param adm The admission controller.
+ * @param opts The daemon options.
+ * @param now The current time, in nanoseconds.
+ * @return 1 if the work should be accepted, 0 if it should be shed.
+ */
+static inline int admission_accept(admission_t *adm, const options_t *opts, uint64_t now) {
+	double burst = adm->accept_rate * opts->control_interval_ms / 1000.0;
+	
+	if (burst < 1.0) {
+		burst = 1.0;
+	}
+	adm->tokens += adm->accept_rate * (double) (now - adm->last_refill_ns) / 1e9;
+	if (adm->tokens > burst) {
+		adm->tokens = burst;
+	}
+	adm->last_refill_ns = now;
+	
+	if (adm->tokens < 1.0) {
+		return 0;
+	}
+	adm->tokens -= 1.0;
+	return 1;
+}
+
+/**
+ * Decides whether accepted work should be queued, according to the current
+ * in-flight limit.
+ * @param adm The admission controller.
+ * @param inflight The amount of work already queued or being processed.
+ * @return 1 if the work should be queued, 0 if it should be shed.
+ */
+static inline int admission_begin(const admission_t *adm, unsigned long inflight) {
+	return inflight < adm->limit;
+}
+
+/**
+ * Decides whether dequeued work waited so long that whoever sent it has
+ * most likely given up, and it should be shed rather than processed.
+ * @param opts The daemon options.
+ * @param qlat How long the work was queued for, in nanoseconds.
+ * @return 1 if the work should be shed, 0 if it should be processed.
+ */
+static inline int admission_expired(const options_t *opts, uint64_t qlat) {
+	return qlat > (uint64_t) opts->queue_shed_us * 1000;
+}
+
+/**
+ * Records how long dequeued work was queued for, so that it's taken into
+ * account by the next admission_update.
+ * @param adm The admission controller.
+ * @param qlat The queue latency, in nanoseconds.
+ */
+static inline void admission_observe(admission_t *adm, uint64_t qlat) {
+	if (qlat > adm->qlat_max_ns) {
+		adm->qlat_max_ns = qlat;
+	}
+}
+
+/**
+ * Adjusts the in-flight limit and the accept rate, AIMD-style: both are
+ * cut multiplicatively if there was any resource pressure or the queue
+ * latency went over target during the last interval, and are otherwise
+ * increased additively.
+ * @param adm The admission controller.
+ * @param opts The daemon options.
+ * @param pressure A bitmask of pressured resources, as from psi_pressure.
+ */
+static void admission_update(admission_t *adm, const options_t *opts, unsigned pressure) {
+	unsigned long long limit = adm->limit;
+	char congested = pressure != 0 || adm->qlat_max_ns > (uint64_t) opts->queue_target_us * 1000;
+	
+	if (congested) {
+		limit = limit * AIMD_DECREASE_PERCENT / 100;
+		adm->accept_rate = adm->accept_rate * AIMD_DECREASE_PERCENT / 100;
+	} else {
+		limit += AIMD_INFLIGHT_INCREASE;
+		adm->accept_rate += (double) opts->max_accept_rate / AIMD_ACCEPT_RATE_DIVISOR;
+	}
+	
+	if (limit < opts->min_inflight) {
+		limit = opts->min_inflight;
+	} else if (limit > opts->max_inflight) {
+		limit = opts->max_inflight;
+	}
+	adm->limit = (unsigned) limit;
+	if (adm->accept_rate < opts->min_accept_rate) {
+		adm->accept_rate = (double) opts->min_accept_rate;
+	} else if (adm->accept_rate > opts->max_accept_rate) {
+		adm->accept_rate = (double) opts->max_accept_rate;
+	}
+	
+	if (congested && !adm->congested) {
+		syslog(LOG_NOTICE, "%s: backing off (pressure:%s%s%s, queue latency %lluus), in-flight limit %u, accept rate %.0f/s",
+			adm->name, (pressure & 1) ? " cpu" : "", (pressure & 2) ? " memory" : "",
+			(pressure & 4) ? " io" : "", (unsigned long long) (adm->qlat_max_ns / 1000),
+			adm->limit, adm->accept_rate);
+	} else if (!congested && adm->congested) {
+		syslog(LOG_NOTICE, "%s: recovering, in-flight limit %u, accept rate %.0f/s", adm->name,
+			adm->limit, adm->accept_rate);
+	} else if (opts->verbose) {
+		syslog(LOG_DEBUG, "%s: in-flight limit %u, accept rate %.0f/s", adm->name,
+			adm->limit, adm->accept_rate);
+	}
+	adm->congested = congested;
+	adm->qlat_max_ns = 0;
+}
+
+/**
+ * Calls admission_update with the published resource pressure, if a
+ * control interval has passed since the last adjustment. The thread which
+ * owns the controller should call this at least once per control interval,
+ * including while it's idle.
+ * @param adm The admission controller.
+ * @param opts The daemon options.
+ * @param now The current time, in nanoseconds.
+ */
+static void admission_tick(admission_t *adm, const options_t *opts, uint64_t now) {
+	if (now - adm->last_update_ns < (uint64_t) opts->control_interval_ms * 1000000) {
+		return;
+	}
+	admission_update(adm, opts, __atomic_load_n(&admission_pressure, __ATOMIC_RELAXED));
+	adm->last_update_ns = now;
+}
+
+//----------------------------------------------------------------------------//
+// -*'^'*-,__,-*'^'*-,__,-*'^'*-, UDP ingestion -*'^'*-,__,-*'^'*-,__,-*'^'*- //
+//----------------------------------------------------------------------------//
+
+/**
+ * Datagram handler, called by the consumer threads for every datagram
+ * received. Datagram processing goes here. The data is only valid until
+ * this function returns, and the function may be called concurrently by
+ * the consumer threads of different workers.
+ * @param w The worker the datagram was received by.
+ * @param dg The datagram.
+ */
+static void udp_handle_datagram(udp_worker_t *w, const udp_datagram_t *dg) {
+	(void) w;
+	(void) dg;
+}
+
+/**
+ * Allocates the buffers of a batch, and points its message headers at them.
+ * @param b The batch to allocate.
+ * @param opts The daemon options.
+ * @return 0 on success, -1 on failure.
+ */
+static int udp_batch_alloc(udp_batch_t *b, const options_t *opts) {
+	unsigned i;
+	
+	memset((void*) b, 0, sizeof(*b));
+	b->msgs = (struct mmsghdr*) calloc(opts->udp_batch, sizeof(*b->msgs));
+	b->iovs = (struct iovec*) calloc(opts->udp_batch, sizeof(*b->iovs));
+	b->addrs = (struct sockaddr_storage*) calloc(opts->udp_batch, sizeof(*b->addrs));
+	b->bufs = (uint8_t*) malloc((size_t) opts->udp_batch * opts->udp_buf_size);
+	b->ctrl = (uint8_t*) malloc((size_t) opts->udp_batch * UDP_CTRL_SIZE);
+	b->dgrams = (udp_datagram_t*) calloc((size_t) opts->udp_batch * UDP_MAX_GRO_SEGMENTS, sizeof(*b->dgrams));
+	if (!b->msgs || !b->iovs || !b->addrs || !b->bufs || !b->ctrl || !b->dgrams) {
+		return -1;
+	}
+	
+	for (i = 0; i < opts->udp_batch; i++) {
+		b->iovs[i].iov_base = b->bufs + (size_t) i * opts->udp_buf_size;
+		b->iovs[i].iov_len = opts->udp_buf_size;
+		b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+		b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_control = b->ctrl + (size_t) i * UDP_CTRL_SIZE;
+	}
+	return 0;
+}
+
+/**
+ * Frees the buffers of a batch allocated by udp_batch_alloc.
+ * @param b The batch to free.
+ */
+static void udp_batch_free(udp_batch_t *b) {
+	free((void*) b->msgs);
+	free((void*) b->iovs);
+	free((void*) b->addrs);
+	free((void*) b->bufs);
+	free((void*) b->ctrl);
+	free((void*) b->dgrams);
+}
+
+/**
+ * Opens and binds a UDP ingestion socket. Every worker opens its own
+ * socket on the same port with SO_REUSEPORT, so that the kernel spreads
+ * incoming flows across the workers.
+ * @param opts The daemon options.
+ * @param gro Set to whether UDP GRO could be enabled on the socket.
+ * @return The socket, or -1 on failure.
+ */
+static int udp_open_socket(const options_t *opts, int *gro) {
+	struct addrinfo hints, *ai = NULL;
+	struct timeval tv;
+	char port[8];
+	int fd = -1, one = 1, rcvbuf = (int) opts->udp_rcvbuf, err;
+	unsigned timeout_ms = UDP_RECV_TIMEOUT_MS;
+	
+	memset((void*) &hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+	snprintf(port, sizeof(port), "%u", opts->udp_port);
+	if ((err = getaddrinfo(opts->udp_bind, port, &hints, &ai)) != 0) {
+		syslog(LOG_ERR, "invalid udp_bind address \"%s\": %s", opts->udp_bind, gai_strerror(err));
+		return -1;
+	}
+	
+	fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror_syslog("socket");
+		goto err;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		perror_syslog("setsockopt(SO_REUSEPORT)");
+		goto err;
+	}
+	// report the socket's kernel drop count with every datagram
+	if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) < 0) {
+		perror_syslog("setsockopt(SO_RXQ_OVFL)");
+		goto err;
+	}
+	// UDP GRO needs Linux 5.0 or later - carry on without it otherwise
+	*gro = setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+	if (rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
+		perror_syslog("setsockopt(SO_RCVBUF)");
+		goto err;
+	}
+	// wake up periodically to check whether the worker should stop, and to
+	// keep the admission controller adapting while idle
+	if (opts->adaptive && opts->control_interval_ms < timeout_ms) {
+		timeout_ms = opts->control_interval_ms;
+	}
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		perror_syslog("setsockopt(SO_RCVTIMEO)");
+		goto err;
+	}
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+		perror_syslog("could not bind to %s port %u", opts->udp_bind, opts->udp_port);
+		goto err;
+	}
+	
+	freeaddrinfo(ai);
+	return fd;
+	
+err:
+	if (fd >= 0) {
+		close(fd);
+	}
+	freeaddrinfo(ai);
+	return -1;
+}
+
+/**
+ * Splits the datagrams received into a batch into b->dgrams. Datagrams
+ * coalesced by UDP GRO are split back into their original segments, in
+ * place. Segments which don't fit in b->dgrams are counted as received and
+ * overflowed, then dropped. Also picks up the socket's drop count from
+ * SO_RXQ_OVFL.
+ * @param w The worker the batch was received by.
+ * @param b The batch.
+ * @param n The number of messages recvmmsg() returned.
+ */
+static void udp_parse_batch(udp_worker_t *w, udp_batch_t *b, unsigned n) {
+	unsigned i, cap = w->opts->udp_batch * UDP_MAX_GRO_SEGMENTS;
+	unsigned long long bytes = 0, truncated = 0, overflowed = 0;
+	size_t len, seg, off;
+	uint32_t ovfl = 0;
+	int gso, have_ovfl = 0;
+	struct msghdr *mh;
+	struct cmsghdr *cm;
+	udp_datagram_t *dg;
+	
+	b->ndgrams = 0;
+	for (i = 0; i < n; i++) {
+		mh = &b->msgs[i].msg_hdr;
+		len = b->msgs[i].msg_len;
+		seg = 0;
+		for (cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)) {
+			if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+				memcpy(&gso, CMSG_DATA(cm), sizeof(gso));
+				seg = (size_t) gso;
+			} else if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+				memcpy(&ovfl, CMSG_DATA(cm), sizeof(ovfl));
+				have_ovfl = 1;
+			}
+		}
+		if (mh->msg_flags & MSG_TRUNC) {
+			truncated++;
+		}
+		bytes += len;
+		
+		// not coalesced - the whole message is one datagram
+		if (seg == 0 || seg > len) {
+			seg = len;
+		}
+		off = 0;
+		do {
+			if (b->ndgrams == cap) {
+				// no room left - count the rest, rather than lose them silently
+				overflowed++;
+			} else {
+				dg = &b->dgrams[b->ndgrams++];
+				dg->data = (const uint8_t*) mh->msg_iov->iov_base + off;
+				dg->len = len - off < seg ? len - off : seg;
+				dg->from = (const struct sockaddr*) mh->msg_name;
+			}
+			off += seg;
+		} while (off < len);
+	}
+	
+	__atomic_fetch_add(&w->packets, b->ndgrams + overflowed, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&w->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&w->batches, 1, __ATOMIC_RELAXED);
+	if (truncated) {
+		__atomic_fetch_add(&w->truncated, truncated, __ATOMIC_RELAXED);
+	}
+	if (overflowed) {
+		__atomic_fetch_add(&w->overflowed, overflowed, __ATOMIC_RELAXED);
+	}
+	if (have_ovfl) {
+		// the kernel reports a running total for the socket
+		__atomic_store_n(&w->drops, ovfl, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Passes each datagram of a parsed batch through the admission controller's
+ * accept rate, moving the accepted ones to the front of the batch.
+ * @param w The worker the batch was received by.
+ * @param b The batch.
+ * @return The number of datagrams accepted.
+ */
+static unsigned udp_accept_batch(udp_worker_t *w, udp_batch_t *b) {
+	unsigned i, n = 0;
+	
+	for (i = 0; i < b->ndgrams; i++) {
+		if (admission_accept(&w->adm, w->opts, b->received_ns)) {
+			b->dgrams[n++] = b->dgrams[i];
+		}
+	}
+	if (n < b->ndgrams) {
+		trace_instant("shed");
+		__atomic_fetch_add(&w->shed, b->ndgrams - n, __ATOMIC_RELAXED);
+		b->ndgrams = n;
+	}
+	return n;
+}
+
+/**
+ * Receiving thread. Reads batches of datagrams with recvmmsg() into free
+ * batches from the ring, and hands them to the consumer thread. When
+ * adaptive concurrency control is enabled, datagrams are shed here, before
+ * they're queued: one by one according to the accept rate, and a batch at
+ * a time once the in-flight limit of queued batches is reached.
+ * @param arg The worker.
+ * @return NULL.
+ */
+static void *udp_rx_thread(void *arg) {
+	udp_worker_t *w = (udp_worker_t*) arg;
+	const options_t *opts = w->opts;
+	udp_batch_t *b;
+	char name[16];
+	unsigned i;
+	int n;
+	
+	snprintf(name, sizeof(name), "udp-rx-%u", w->index);
+	trace_set_thread_name(name);
+	snprintf(w->adm_name, sizeof(w->adm_name), "UDP worker %u", w->index);
+	admission_init(&w->adm, opts, w->adm_name, monotonic_ns());
+	
+	for (;;) {
+		if (opts->adaptive) {
+			admission_observe(&w->adm, __atomic_exchange_n(&w->qlat_max_ns, 0, __ATOMIC_RELAXED));
+			admission_tick(&w->adm, opts, monotonic_ns());
+		}
+		
+		// wait for a free batch. While the consumer is behind, datagrams
+		// queue up in the socket, and are counted by SO_RXQ_OVFL if dropped.
+		pthread_mutex_lock(&w->lock);
+		while (w->produced - w->consumed == opts->udp_ring && !w->stop) {
+			trace_instant("ring full");
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		pthread_mutex_unlock(&w->lock);
+		if (__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) {
+			break;
+		}
+		
+		b = &w->ring[w->produced % opts->udp_ring];
+		for (i = 0; i < opts->udp_batch; i++) {
+			b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+			b->msgs[i].msg_hdr.msg_controllen = UDP_CTRL_SIZE;
+			b->msgs[i].msg_hdr.msg_flags = 0;
+		}
+		// block for the first datagram only, then take whatever is queued
+		trace_begin("recvmmsg");
+		n = recvmmsg(w->fd, b->msgs, opts->udp_batch, MSG_WAITFORONE, NULL);
+		trace_end("recvmmsg");
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				continue;
+			}
+			perror_syslog("recvmmsg");
+			break;
+		}
+		b->received_ns = monotonic_ns();
+		trace_begin("parse");
+		udp_parse_batch(w, b, (unsigned) n);
+		trace_end("parse");
+		if (opts->adaptive && udp_accept_batch(w, b) == 0) {
+			continue;
+		}
+		
+		pthread_mutex_lock(&w->lock);
+		if (opts->adaptive && !admission_begin(&w->adm, w->produced - w->consumed)) {
+			pthread_mutex_unlock(&w->lock);
+			trace_instant("shed");
+			__atomic_fetch_add(&w->shed, b->ndgrams, __ATOMIC_RELAXED);
+			continue;
+		}
+		w->produced++;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+	
+	pthread_mutex_lock(&w->lock);
+	w->rx_done = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/**
+ * Consumes a batch, passing each datagram to udp_handle_datagram. When
+ * adaptive concurrency control is enabled, reports how long the batch was
+ * queued for to the receiving thread, and sheds it if that was too long.
+ * @param w The worker.
+ * @param b The batch.
+ * @param now The current time, in nanoseconds.
+ */
+static void udp_consume(udp_worker_t *w, udp_batch_t *b, uint64_t now) {
+	uint64_t qlat = now - b->received_ns, max;
+	unsigned i;
+	
+	if (w->opts->adaptive) {
+		max = __atomic_load_n(&w->qlat_max_ns, __ATOMIC_RELAXED);
+		while (qlat > max && !__atomic_compare_exchange_n(&w->qlat_max_ns, &max, qlat, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		}
+		if (admission_expired(w->opts, qlat)) {
+			trace_instant("shed");
+			__atomic_fetch_add(&w->shed, b->ndgrams, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+	
+	for (i = 0; i < b->ndgrams; i++) {
+		udp_handle_datagram(w, &b->dgrams[i]);
+	}
+}
+
+/**
+ * Consumer thread. Takes batches from the ring in order, consumes them, and
+ * hands them back to the receiving thread. Exits once the ring is empty and
+ * either the receiving thread has exited or the worker is stopping.
+ * @param arg The worker.
+ * @return NULL.
+ */
+static void *udp_consumer_thread(void *arg) {
+	udp_worker_t *w = (udp_worker_t*) arg;
+	unsigned nslots = w->opts->udp_ring;
+	char name[16];
+	int done;
+	
+	snprintf(name, sizeof(name), "udp-consume-%u", w->index);
+	trace_set_thread_name(name);
+	
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		// also stop on w->stop, in case the receiving thread never started
+		while (w->consumed == w->produced && !w->rx_done && !w->stop) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		done = w->consumed == w->produced;
+		pthread_mutex_unlock(&w->lock);
+		if (done) {
+			break;
+		}
+		
+		trace_begin("consume");
+		udp_consume(w, &w->ring[w->consumed % nslots], monotonic_ns());
+		trace_end("consume");
+		
+		pthread_mutex_lock(&w->lock);
+		w->consumed++;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+	return NULL;
+}
+
+/**
+ * Returns the CPU time used so far by a thread.
+ * @param thread The thread.
+ * @return The CPU time in nanoseconds, or 0 if it couldn't be read.
+ */
+static uint64_t thread_cpu_ns(pthread_t thread) {
+	clockid_t cid;
+	struct timespec ts;
+	
+	if (pthread_getcpuclockid(thread, &cid) != 0 || clock_gettime(cid, &ts) < 0) {
+		return 0;
+	}
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Stops the UDP workers, waiting for their threads to exit, and frees
+ * everything allocated by udp_start. Logs a summary of each worker's
+ * statistics if verbose logging is enabled.
+ * @param udp The UDP ingestion state.
+ */
+static void udp_stop(udp_ingest_t *udp) {
+	udp_worker_t *w;
+	unsigned i, j;
+	
+	for (i = 0; i < udp->nworkers; i++) {
+		w = &udp->workers[i];
+		pthread_mutex_lock(&w->lock);
+		__atomic_store_n(&w->stop, 1, __ATOMIC_RELAXED);
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+	
+	for (i = 0; i < udp->nworkers; i++) {
+		w = &udp->workers[i];
+		if (w->rx_started) {
+			pthread_join(w->rx_thread, NULL);
+		}
+		if (w->consumer_started) {
+			pthread_join(w->consumer_thread, NULL);
+		}
+		if (w->opts->verbose) {
+			syslog(LOG_INFO, "UDP worker %u: %llu datagrams, %llu bytes in %llu batches, "
+				"%llu dropped, %llu truncated, %llu overflowed, %llu shed", w->index, w->packets,
+				w->bytes, w->batches, w->drops, w->truncated, w->overflowed, w->shed);
+		}
+		if (w->fd >= 0) {
+			close(w->fd);
+		}
+		if (w->ring != NULL) {
+			for (j = 0; j < w->opts->udp_ring; j++) {
+				udp_batch_free(&w->ring[j]);
+			}
+			free((void*) w->ring);
+		}
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+	}
+	
+	free((void*) udp->workers);
+	udp->workers = NULL;
+	udp->nworkers = 0;
+}
+
+/**
+ * Starts the UDP workers: opens a socket per worker, preallocates its
+ * batch ring, and starts its receiving and consumer threads.
+ * @param udp The UDP ingestion state to initialize.
+ * @param opts The daemon options.
+ * @return 0 on success, -1 on failure, in which case nothing is left running.
+ */
+static int udp_start(udp_ingest_t *udp, const options_t *opts) {
+	udp_worker_t *w;
+	sigset_t all, old;
+	unsigned i, j;
+	int gro = 1, sock_gro, ret = 0;
+	
+	udp->nworkers = 0;
+	udp->workers = (udp_worker_t*) calloc(opts->udp_workers, sizeof(*udp->workers));
+	if (udp->workers == NULL) {
+		perror_syslog("could not allocate UDP workers");
+		return -1;
+	}
+	
+	// the worker threads inherit this mask, leaving signals to the main thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	
+	for (i = 0; i < opts->udp_workers; i++) {
+		w = &udp->workers[i];
+		w->index = i;
+		w->opts = opts;
+		w->fd = -1;
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		udp->nworkers++;
+		
+		w->ring = (udp_batch_t*) calloc(opts->udp_ring, sizeof(*w->ring));
+		if (w->ring == NULL) {
+			perror_syslog("could not allocate UDP ring");
+			ret = -1;
+			break;
+		}
+		for (j = 0; j < opts->udp_ring; j++) {
+			if (udp_batch_alloc(&w->ring[j], opts) < 0) {
+				perror_syslog("could not allocate UDP batch");
+				ret = -1;
+				break;
+			}
+		}
+		if (ret < 0 || (w->fd = udp_open_socket(opts, &sock_gro)) < 0) {
+			ret = -1;
+			break;
+		}
+		gro &= sock_gro;
+		if (pthread_create(&w->consumer_thread, NULL, udp_consumer_thread, w) != 0) {
+			syslog(LOG_ERR, "could not start UDP consumer thread");
+			ret = -1;
+			break;
+		}
+		w->consumer_started = 1;
+		if (pthread_create(&w->rx_thread, NULL, udp_rx_thread, w) != 0) {
+			syslog(LOG_ERR, "could not start UDP receiving thread");
+			ret = -1;
+			break;
+		}
+		w->rx_started = 1;
+	}
+	
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	
+	if (ret < 0) {
+		udp_stop(udp);
+		return -1;
+	}
+	if (!gro) {
+		syslog(LOG_WARNING, "UDP GRO could not be enabled on every socket, reading datagrams individually");
+	}
+	if (opts->verbose) {
+		syslog(LOG_INFO, "Ingesting UDP on %s port %u with %u workers", opts->udp_bind,
+			opts->udp_port, udp->nworkers);
+	}
+	return 0;
+}
+
+/**
+ * Logs each worker's receive rate since the last call. The per-core rate
+ * divides by the CPU time used by the worker's two threads, so it stays
+ * meaningful when the threads aren't busy all of the time.
+ * @param udp The UDP ingestion state.
+ * @param elapsed_ns The time since the last call, in nanoseconds.
+ */
+static void udp_log_stats(udp_ingest_t *udp, uint64_t elapsed_ns) {
+	unsigned long long packets;
+	uint64_t cpu_ns;
+	double dpackets, dcpu;
+	udp_worker_t *w;
+	unsigned i;
+	
+	for (i = 0; i < udp->nworkers; i++) {
+		w = &udp->workers[i];
+		packets = __atomic_load_n(&w->packets, __ATOMIC_RELAXED);
+		cpu_ns = thread_cpu_ns(w->rx_thread) + thread_cpu_ns(w->consumer_thread);
+		dpackets = (double) (packets - w->last_packets);
+		dcpu = (double) (cpu_ns - w->last_cpu_ns);
+		syslog(LOG_INFO, "UDP worker %u: %.0f pkt/s, %.0f pkt/s per core (%.0f%% cpu), "
+			"%llu dropped, %llu truncated, %llu overflowed, %llu shed", w->index,
+			dpackets * 1e9 / (double) elapsed_ns, dcpu > 0 ? dpackets * 1e9 / dcpu : 0.0,
+			dcpu * 100.0 / (double) elapsed_ns,
+			(unsigned long long) __atomic_load_n(&w->drops, __ATOMIC_RELAXED),
+			(unsigned long long) __atomic_load_n(&w->truncated, __ATOMIC_RELAXED),
+			(unsigned long long) __atomic_load_n(&w->overflowed, __ATOMIC_RELAXED),
+			(unsigned long long) __atomic_load_n(&w->shed, __ATOMIC_RELAXED));
+		w->last_packets = packets;
+		w->last_cpu_ns = cpu_ns;
+	}
+}
+
 //----------------------------------------------------------------------------//
 // -*'^'*-,__,-*'^'*-,__,-*'^'*-, Core routines -*'^'*-,__,-*'^'*-,__,-*'^'*- //
 //----------------------------------------------------------------------------//
 
+/// Set by the SIGTERM/SIGINT handler to make daemon_main return.
+static volatile sig_atomic_t stop_requested = 0;
+
+/**
+ * SIGTERM/SIGINT handler. Asks daemon_main to return.
+ * @param sig The signal number.
+ */
+static void handle_stop_signal(int sig) {
+	(void) sig;
+	stop_requested = 1;
+}
+
 /**
  * Main daemon function.
  * @param opts Command-line options for the daemon core.
  * @return 0 on success, anything else on failure
  */
 static int daemon_main(options_t *opts) {
-	// main daemon functionality goes here
-	return 0;
+	int ret = 0, n, nfds = 0, timeout;
+	uint64_t now, last_tick, last_stats, interval_ns = (uint64_t) opts->control_interval_ms * 1000000;
+	struct sigaction sa;
+	struct pollfd pfds[PSI_NUM_RESOURCES];
+	psi_monitor_t psi;
+	admission_t adm;
+	udp_ingest_t udp;
+	
+	memset((void*) &sa, 0, sizeof(sa));
+	sa.sa_handler = handle_stop_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	
+	if (opts->udp_port != 0 && udp_start(&udp, opts) < 0) {
+		return 1;
+	}
+	
+	last_tick = last_stats = monotonic_ns();
+	admission_init(&adm, opts, "main", last_tick);
+	if (opts->adaptive) {
+		psi_open(&psi, opts);
+		nfds = psi_pollfds(&psi, pfds);
+	}
+	
+	while (!stop_requested) {
+		// sleep until the next control interval, or until a PSI trigger fires
+		now = monotonic_ns();
+		timeout = now - last_tick >= interval_ns ? 0 : (int) ((interval_ns - (now - last_tick) + 999999) / 1000000);
+		trace_begin("poll");
+		n = poll(pfds, nfds, timeout);
+		trace_end("poll");
+		if (n < 0) {
+			if (errno != EINTR) {
+				perror_syslog("poll");
+				ret = 1;
+				break;
+			}
+			// interrupted by a signal - carry on, in case it was SIGUSR1
+			n = 0;
+		}
+		now = monotonic_ns();
+		if (n > 0) {
+			trace_instant("psi trigger");
+			if (psi_handle_events(&psi, pfds, nfds, now)) {
+				nfds = psi_pollfds(&psi, pfds);
+			}
+		}
+		
+		if (now - last_tick >= interval_ns) {
+			trace_begin("control");
+			if (opts->adaptive) {
+				// publish the pressure for all admission controllers, then
+				// adapt our own
+				__atomic_store_n(&admission_pressure, psi_pressure(&psi, now, (now - last_tick) / 1000),
+					__ATOMIC_RELAXED);
+				admission_tick(&adm, opts, now);
+			}
+			last_tick = now;
+			trace_end("control");
+		}
+		
+		if (opts->udp_port != 0 && opts->verbose && now - last_stats >= (uint64_t) UDP_STATS_INTERVAL_MS * 1000000) {
+			udp_log_stats(&udp, now - last_stats);
+			last_stats = now;
+		}
+		
+		if (trace_dump_requested) {
+			trace_dump_requested = 0;
+			trace_begin("trace dump");
+			if (!trace_enabled) {
+				syslog(LOG_NOTICE, "Tracing is disabled, not dumping a trace");
+			} else if (trace_dump(opts->trace_file) < 0) {
+				perror_syslog("could not dump trace to %s", opts->trace_file);
+			} else if (opts->verbose) {
+				syslog(LOG_INFO, "Dumped trace to %s", opts->trace_file);
+			}
+			trace_end("trace dump");
+		}
+		
+		// main daemon functionality goes here. When opts->adaptive is set,
+		// shed work which fails admission_accept() as it arrives, or
+		// admission_begin() before it's queued, and which is
+		// admission_expired() once dequeued, reporting its queue latency with
+		// admission_observe(). Work done in other threads should be gated
+		// through an admission controller owned by the thread doing it, as
+		// the UDP receiving threads do.
+	}
+	
+	if (opts->udp_port != 0) {
+		udp_stop(&udp);
+	}
+	if (opts->adaptive) {
+		psi_close(&psi);
+	}
+	if (opts->trace && trace_dump(opts->trace_file) < 0) {
+		perror_syslog("could not dump trace to %s", opts->trace_file);
+	}
+	return ret;
 }
 
 int main(int argc, char * const argv[]) {
 	int ret;
 	pid_t pid, sid;
 	options_t opts;
+	struct sigaction sa;
 
 	if (daemon_name == NULL) {
 		daemon_name = argv[0];
@@ -617,6 +2376,17 @@ int main(int argc, char * const argv[]) {
 		exit(EXIT_FAILURE);
 	}
 	
+	// start tracing straight away if asked to on the command-line, so that
+	// config file parsing is traced too. SIGUSR1 is handled from here on, so
+	// that it can't kill the daemon during any of the traced phases.
+	memset((void*) &sa, 0, sizeof(sa));
+	sa.sa_handler = handle_trace_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	if (opts.trace) {
+		trace_init();
+	}
+	
 	// check if a default config file, should be read, if none were specified
 	// on the command-line, doing so only if it actually exists too.
 #if (DEFAULT_CONFIG_FILE_PATH != 0)
@@ -629,6 +2399,7 @@ int main(int argc, char * const argv[]) {
 #endif
 	
 	// parse the config file, if any
+	trace_begin("config parse");
 	if (opts.config_file) {
 		char *cfg_data = read_entire_file(opts.config_file);
 		if (cfg_data == NULL) {
@@ -647,9 +2418,22 @@ int main(int argc, char * const argv[]) {
 			}
 		}
 	}
+	
+	trace_end("config parse");
+	
+	if (check_options(&opts) < 0) {
+		exit(EXIT_FAILURE);
+	}
+	
+	// tracing may also have been enabled by the config file
+	if (opts.trace) {
+		trace_init();
+		trace_set_thread_name("main");
+	}
 
 	// check whether to daemonize or not
 	if (opts.background == 1) {
+		trace_begin("fork");
 		pid = fork();
 		if (pid < 0) {
 			// log any errors here
@@ -660,6 +2444,8 @@ int main(int argc, char * const argv[]) {
 			printf("Forked, background PID: %u\n", (unsigned) pid);
 			exit(EXIT_SUCCESS);
 		}
+		trace_after_fork();
+		trace_end("fork");
 	}
 
 	// change the file mode mask
@@ -669,7 +2455,9 @@ int main(int argc, char * const argv[]) {
 	openlog((const char*) opts.syslog_ident, LOG_NDELAY | LOG_PID, LOG_DAEMON);
 
 	// create a new session
+	trace_begin("setsid");
 	sid = setsid();
+	trace_end("setsid");
 	if (sid < 0) {
 		perror_syslog("setsid");
 		closelog(); // closelog is optional, but may as well be clean